@@ -0,0 +1,47 @@
+#!/bin/sh
+# Cold-cache comparison of the default traversal and the inode order mode (-i).
+# Page, dentry and inode caches are dropped before every run, so root is required.
+#
+# Usage: bench/cold_cache.sh <cdir_snapshot binary> <directory> [runs]
+
+BIN="$1"
+DIR="$2"
+RUNS="${3:-3}"
+LISTING="/tmp/cdir_snapshot_bench.lst"
+
+if [ -z "$BIN" ] || [ -z "$DIR" ]; then
+  echo "Usage: $0 <cdir_snapshot binary> <directory> [runs]"
+  exit 1
+fi
+if [ "$(id -u)" -ne 0 ]; then
+  echo "Error: root is required to drop caches"
+  exit 1
+fi
+if [ ! -x "$BIN" ] || [ ! -d "$DIR" ]; then
+  echo "Error: $BIN is not executable or $DIR is not a directory"
+  exit 1
+fi
+
+dropCaches() {
+  sync
+  echo 3 > /proc/sys/vm/drop_caches
+}
+
+# print the wall time of a single cold-cache run in seconds
+timeRun() {
+  dropCaches
+  start=$(date +%s.%N)
+  "$BIN" "$DIR" -l "$LISTING" "$@" > /dev/null
+  end=$(date +%s.%N)
+  echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+echo "mode       run  seconds"
+i=1
+while [ "$i" -le "$RUNS" ]; do
+  # alternate the modes so drift affects both the same way
+  echo "default    $i    $(timeRun)"
+  echo "inode (-i) $i    $(timeRun -i)"
+  i=$((i + 1))
+done
+rm -f "$LISTING"
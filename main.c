@@ -3,6 +3,10 @@
 int main(int argc, char** argv) {
   char rootDirPath[FILE_NAME_LENGTH];
   int opt, result;
+  struct option longOptions[] = {
+    { "resume", no_argument, NULL, 'R' },
+    { NULL, 0, NULL, 0 }
+  };
 
   if (argc < 2 || !isDirectory(argv[1], "")) {
     printUsage(argv[0]);
@@ -12,7 +16,7 @@ int main(int argc, char** argv) {
   memset(rootDirPath, 0, FILE_NAME_LENGTH);
   strncpy(rootDirPath, argv[1], FILE_NAME_LENGTH - 1);
   
-  while ((opt = getopt(argc, argv, "cavshf:d:l:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "cavsphinRjSf:d:l:r:e:w:t:k:", longOptions, NULL)) != -1) {
     switch (opt) {
       case 'v':
         setVerboseMode();
@@ -26,6 +30,51 @@ int main(int argc, char** argv) {
       case 's':
         setSeparateListingMode();
         break;
+      case 'p':
+        setFrontCodedListingMode();
+        break;
+      case 'i':
+        setInodeOrderMode();
+        break;
+      case 'n':
+        setIdlePriorityMode();
+        break;
+      case 'r':
+        if (!setDirRateLimit(optarg)) {
+          printf("Invalid rate '%s' for -%c\n", optarg, opt);
+          printUsage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'e':
+        if (!setEntryRateLimit(optarg)) {
+          printf("Invalid rate '%s' for -%c\n", optarg, opt);
+          printUsage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'w':
+        if (!setWriteRateLimit(optarg)) {
+          printf("Invalid rate '%s' for -%c\n", optarg, opt);
+          printUsage(argv[0]);
+          return 1;
+        }
+        break;
+      case 't':
+        setThrottleControlFile(optarg);
+        break;
+      case 'k':
+        setCheckpointFileName(optarg);
+        break;
+      case 'R':
+        setResumeMode();
+        break;
+      case 'j':
+        setDiffOutputMode(DIFF_JSON);
+        break;
+      case 'S':
+        setDiffOutputMode(DIFF_SUMMARY);
+        break;
       case 'l':
         setListingFileName(optarg);
         break;
@@ -44,6 +93,11 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (!checkCheckpointOptions() || !checkOutputOptions()) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
   printLog(LOG_INFO, rootDirPath, 0);
   if (rootDirPath[strlen(rootDirPath) - 1] == '/') {
     rootDirPath[strlen(rootDirPath) - 1] = '\0';
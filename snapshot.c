@@ -8,64 +8,86 @@ int processHiddenFiles = 0;
 int quietMode = 1;
 int compareMode = 0;
 int singleListingMode = 1;
+int frontCodedListingMode = 0;
+int inodeOrderMode = 0;
+int idlePriorityMode = 0;
+char throttleControlFile[FILE_NAME_LENGTH] = "";
+TokenBucket dirBucket = { 0 };
+TokenBucket entryBucket = { 0 };
+TokenBucket writeBucket = { 0 };
+volatile sig_atomic_t throttleReloadRequested = 0;
+char checkpointFileName[FILE_NAME_LENGTH] = "";
+int resumeMode = 0;
+int resumedDirectories = 0;
+FILE * checkpointFile = NULL;
+struct stat checkpointStat;
+time_t lastCheckpointSync = 0;
+enum DiffOutput diffOutputMode = DIFF_TEXT;
+DiffSummary diffSummary = { 0 };
+char diffBuffer[DIFF_BUFFER_SIZE];
+size_t diffBufferLen = 0;
 DirTreeNode * singleListing = NULL;
 
 /**
  * Print a usage string
  */
 void printUsage(const char * executableName) {
-  printf("Usage: %s %s\n", executableName, "<directory path> [-sqh] [-d <D>] [-f <F>] [-l <dir.lst>]");
+  printf("Usage: %s %s\n", executableName, "<directory path> [-acjSspinqh] [-d <D>] [-f <F>] [-l <dir.lst>] [-r <dirs/s>] [-e <entries/s>] [-w <bytes/s>] [-t <control file>] [-k <checkpoint> [-R]]");
   printf("Options:\n");
   printf("\t-a - process hidden files. Disabled by default.\n");
   printf("\t-s - separate listing mode. Save items in a separate file for each directory\n");
+  printf("\t-p - prefix-compressed single listing. Store only the part of a path that differs from the previous one\n");
+  printf("\t-i - inode order mode. Stat and descend into entries sorted by inode number\n");
+  printf("\t-n - idle I/O priority and the lowest CPU priority\n");
+  printf("\t-r - limit directories processed per second. Unlimited by default.\n");
+  printf("\t-e - limit directory entries processed per second. Unlimited by default.\n");
+  printf("\t-w - limit listing write bandwidth in bytes per second. Unlimited by default.\n");
+  printf("\t-t - throttle control file with dirs=, entries=, write= lines. Re-read on SIGHUP.\n");
+  printf("\t-k - periodically save completed directories into a checkpoint file. Single listing mode only.\n");
+  printf("\t-R, --resume - continue from the checkpoint file given with -k\n");
   printf("\t-d - set a custom directory prefix letter. 'D' by default.\n");
   printf("\t-f - set a custom file prefix letter. 'F' by default.\n");
   printf("\t-l - set a custom listing file name. 'dir.lst' by default.\n");
   printf("\t-v - verbose mode.\n");
   printf("\t-c - compare with a previous listing. Do write a new one.\n");
+  printf("\t-j - with -c, print the differences as NDJSON records\n");
+  printf("\t-S - with -c, print only the NDJSON summary record\n");
   printf("\t-h - print usage info\n");
 }
 
 /**
- * Recursive function traversing a directory and writing a listing file
+ * Recursive function traversing a directory and writing a listing file.
+ * A directory listed under a parent node keeps only its last path component
  */
-void processDirectory(const char *dirPath) {
+void processDirectory(const char *dirPath, DirTreeNode *parent) {
+  /* a directory restored from a checkpoint was completed with all its subdirectories */
+  if (resumedDirectories && findDirectory(singleListing, dirPath)) {
+    return;
+  }
   if (isDirectory(dirPath, "")) {
     DIR *dir;
-    char nextDirPath[FILE_NAME_LENGTH]; /* Full path to a next directory */
-    int isDir = 0;
     struct dirent *dirEntry;
+    throttleTake(&dirBucket, 1);
     dir = opendir(dirPath);
     if (dir) { /* only process directories */
-      DirTreeNode *listing = createTree(dirPath);
-      while ((dirEntry = readdir(dir))) {
-        /* skip 'this' and 'parent' directories and existing listing files */
-        if (!strncmp(dirEntry->d_name, ".", FILE_NAME_LENGTH) || 
-            !strncmp(dirEntry->d_name, "..", FILE_NAME_LENGTH) ||
-            !strncmp(dirEntry->d_name, LST_FILE_NAME, FILE_NAME_LENGTH) ||
-            (dirEntry->d_name[0] == '.' && !processHiddenFiles) ){
-          continue;
-        }
-        isDir = isDirectory(dirPath, dirEntry->d_name);
-        if (listing->items) {
-          insertListingItem(listing->items, createNode(dirEntry->d_name, isDir));
-        } else {
-          listing->items = createNode(dirEntry->d_name, isDir);
+      const char *baseName = strrchr(dirPath, '/');
+      DirTreeNode *listing = (parent && baseName) ? createChildTree(parent, baseName + 1) : createTree(dirPath);
+      if (inodeOrderMode) {
+        processDirectoryByInode(dir, listing, dirPath); /* closes the directory */
+      } else {
+        while ((dirEntry = readdir(dir))) {
+          processDirectoryEntry(listing, dirPath, dirEntry->d_name);
         }
-        /* If a current entry is directory, processDirectory(curEntry) */
-        memset(nextDirPath, 0, sizeof(char) * FILE_NAME_LENGTH);
-        snprintf(nextDirPath, sizeof(char) * (FILE_NAME_LENGTH - 1), listPathFormat, dirPath, dirEntry->d_name);
-        processDirectory(nextDirPath);
+        closedir(dir);
       }
-      closedir(dir);
       if (singleListingMode) {
         /* In the single listing mode, collect all the items */
         addToSingleListing(listing);
+        checkpointDirectory(listing);
       } else {
         if (compareMode) {
           DirTreeNode * prevListing = readLilsting(dirPath, listingFileName);
-          compareTrees(prevListing, listing, 1);
-          compareTrees(listing, prevListing, 0);
+          compareListings(prevListing, listing, dirPath);
           freeTree(prevListing);
         } else {
           /* all entries collected, save them into a listing file */
@@ -77,6 +99,561 @@ void processDirectory(const char *dirPath) {
   }
 }
 
+/**
+ * Add a single directory entry to the listing and descend into it
+ * @param listing
+ * @param dirPath
+ * @param name
+ */
+void processDirectoryEntry(DirTreeNode * listing, const char * dirPath, const char * name) {
+  /* If a current entry is directory, processDirectory(curEntry) */
+  if (listDirectoryEntry(listing, dirPath, name) == 1) {
+    descendIntoDirectory(listing, dirPath, name);
+  }
+}
+
+/**
+ * Stat a directory entry and add it to the listing
+ * @param listing
+ * @param dirPath
+ * @param name
+ * @return 1 for a directory, 0 for a file, -1 for a skipped entry
+ */
+int listDirectoryEntry(DirTreeNode * listing, const char * dirPath, const char * name) {
+  int isDir = 0;
+  /* skip 'this' and 'parent' directories and existing listing files */
+  if (!strncmp(name, ".", FILE_NAME_LENGTH) ||
+      !strncmp(name, "..", FILE_NAME_LENGTH) ||
+      !strncmp(name, LST_FILE_NAME, FILE_NAME_LENGTH) ||
+      (name[0] == '.' && !processHiddenFiles) ||
+      isCheckpointFile(dirPath, name)) {
+    return -1;
+  }
+  throttleTake(&entryBucket, 1);
+  isDir = isDirectory(dirPath, name);
+  if (listing->items) {
+    insertListingItem(listing->items, createNode(name, isDir));
+  } else {
+    listing->items = createNode(name, isDir);
+  }
+  return isDir;
+}
+
+/**
+ * Process a subdirectory of the listed directory
+ * @param listing
+ * @param dirPath
+ * @param name
+ */
+void descendIntoDirectory(DirTreeNode * listing, const char * dirPath, const char * name) {
+  char nextDirPath[FILE_NAME_LENGTH]; /* Full path to a next directory */
+  memset(nextDirPath, 0, sizeof(char) * FILE_NAME_LENGTH);
+  snprintf(nextDirPath, sizeof(char) * (FILE_NAME_LENGTH - 1), listPathFormat, dirPath, name);
+  processDirectory(nextDirPath, listing);
+}
+
+/**
+ * Read all the directory's entries first and process them in inode order.
+ * On ext4 readdir returns entries in hash order, so stat-ing them as they
+ * come makes the disk seek back and forth across the inode table.
+ * All the entries are stat-ed in one sweep before descending into any
+ * subdirectory, and the directory is closed before descending.
+ * If the entries can't be buffered, they are processed in readdir order
+ * @param dir (closed by the function)
+ * @param listing
+ * @param dirPath
+ */
+void processDirectoryByInode(DIR * dir, DirTreeNode * listing, const char * dirPath) {
+  DirEntryRef * entries = NULL;
+  size_t count = 0, i;
+  struct dirent *dirEntry;
+
+  if (!readDirectoryEntries(dir, &entries, &count)) {
+    fprintf(stderr, "Error: can't buffer entries of %s [%s], using readdir order\n", dirPath, strerror(errno));
+    freeDirectoryEntries(entries, count);
+    rewinddir(dir);
+    while ((dirEntry = readdir(dir))) {
+      processDirectoryEntry(listing, dirPath, dirEntry->d_name);
+    }
+    closedir(dir);
+    return;
+  }
+  closedir(dir);
+  if (count) {
+    qsort(entries, count, sizeof(DirEntryRef), compareEntryInodes);
+  }
+  for (i = 0; i < count; i++) {
+    entries[i].isDir = listDirectoryEntry(listing, dirPath, entries[i].name) == 1;
+  }
+  for (i = 0; i < count; i++) {
+    if (entries[i].isDir) {
+      descendIntoDirectory(listing, dirPath, entries[i].name);
+    }
+  }
+  freeDirectoryEntries(entries, count);
+}
+
+/**
+ * Read the names and inode numbers of all the directory's entries
+ * @param dir
+ * @param entries (an array allocated by the function)
+ * @param count
+ * @return 0 when memory can't be allocated
+ */
+int readDirectoryEntries(DIR * dir, DirEntryRef ** entries, size_t * count) {
+  DirEntryRef * grown;
+  size_t capacity = 0;
+  struct dirent *dirEntry;
+  while ((dirEntry = readdir(dir))) {
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      grown = (DirEntryRef *)realloc(*entries, capacity * sizeof(DirEntryRef));
+      if (!grown) {
+        return 0;
+      }
+      *entries = grown;
+    }
+    (*entries)[*count].inode = dirEntry->d_ino;
+    (*entries)[*count].isDir = 0;
+    (*entries)[*count].name = strndup(dirEntry->d_name, FILE_NAME_LENGTH - 1);
+    if (!(*entries)[*count].name) {
+      return 0;
+    }
+    (*count)++;
+  }
+  return 1;
+}
+
+/**
+ * Free the buffered directory entries
+ * @param entries
+ * @param count
+ */
+void freeDirectoryEntries(DirEntryRef * entries, size_t count) {
+  size_t i;
+  for (i = 0; i < count; i++) {
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+/**
+ * qsort comparator ordering directory entries by inode number
+ * @param a
+ * @param b
+ * @return
+ */
+int compareEntryInodes(const void * a, const void * b) {
+  ino_t inodeA = ((const DirEntryRef *)a)->inode;
+  ino_t inodeB = ((const DirEntryRef *)b)->inode;
+  return (inodeA > inodeB) - (inodeA < inodeB);
+}
+
+/**
+ * Set up the I/O priority and the runtime-adjustable limits
+ * @return 0 when the control file can't be used
+ */
+int initThrottling() {
+  if (idlePriorityMode) {
+    applyIdlePriority();
+  }
+  if (throttleControlFile[0]) {
+    if (!loadThrottleControlFile()) {
+      return 0;
+    }
+    signal(SIGHUP, requestThrottleReload);
+  }
+  return 1;
+}
+
+/**
+ * Move the process into the idle I/O class and lower its CPU priority,
+ * so the traversal yields the disk to co-located services
+ */
+void applyIdlePriority() {
+#ifdef SYS_ioprio_set
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1) {
+    fprintf(stderr, "Error: can't set idle I/O priority [%s]\n", strerror(errno));
+  }
+#endif
+  if (setpriority(PRIO_PROCESS, 0, IDLE_NICE_LEVEL) == -1) {
+    fprintf(stderr, "Error: can't set nice level [%s]\n", strerror(errno));
+  }
+}
+
+/**
+ * Read the limits from the throttle control file.
+ * Each line is "dirs=N", "entries=N" or "write=N", 0 lifts a limit.
+ * Invalid lines are reported on stderr and keep the previous limit
+ * @return 0 when the file can't be read or has invalid lines
+ */
+int loadThrottleControlFile() {
+  FILE * fd;
+  char buf[FILE_NAME_LENGTH];
+  char key[FILE_NAME_LENGTH];
+  char rate[FILE_NAME_LENGTH];
+  double value;
+  int valid = 1;
+  fd = fopen(throttleControlFile, "r");
+  if (!fd) {
+    fprintf(stderr, "Error: can't read throttle control file %s [%s]\n", throttleControlFile, strerror(errno));
+    return 0;
+  }
+  while (fgets(buf, FILE_NAME_LENGTH * sizeof(char), fd)) {
+    if (buf[strspn(buf, " \t\r\n")] == 0) {
+      continue; /* skip empty lines */
+    }
+    if (sscanf(buf, " %255[^= \t] = %255s", key, rate) != 2 || !parseRate(rate, &value)) {
+      fprintf(stderr, "Error: invalid throttle control line: %s", buf);
+      valid = 0;
+    } else if (!strncmp(key, "dirs", FILE_NAME_LENGTH)) {
+      setBucketRate(&dirBucket, value);
+    } else if (!strncmp(key, "entries", FILE_NAME_LENGTH)) {
+      setBucketRate(&entryBucket, value);
+    } else if (!strncmp(key, "write", FILE_NAME_LENGTH)) {
+      setBucketRate(&writeBucket, value);
+    } else {
+      fprintf(stderr, "Error: unknown throttle control key: %s\n", key);
+      valid = 0;
+    }
+  }
+  fclose(fd);
+  printLog(LOG_INFO, "Throttle limits loaded", 0);
+  return valid;
+}
+
+/**
+ * Parse a non-negative finite rate, the whole string has to be a number
+ * @param str
+ * @param value
+ * @return 0 for an invalid rate
+ */
+int parseRate(const char * str, double * value) {
+  char * end;
+  errno = 0;
+  *value = strtod(str, &end);
+  if (end == str || *end != 0 || errno == ERANGE) {
+    return 0;
+  }
+  return *value >= 0 && *value < HUGE_VAL;
+}
+
+/**
+ * SIGHUP handler. The control file is re-read on the next throttled call
+ */
+void requestThrottleReload(int sig) {
+  (void) sig;
+  throttleReloadRequested = 1;
+}
+
+/**
+ * Change a bucket's rate. The bucket starts full, allowing a one second burst
+ * @param bucket
+ * @param rate
+ */
+void setBucketRate(TokenBucket * bucket, double rate) {
+  bucket->rate = rate > 0 ? rate : 0;
+  bucket->tokens = bucket->rate;
+  clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/**
+ * Take tokens from a bucket, sleeping until enough of them are refilled
+ * @param bucket
+ * @param amount
+ */
+void throttleTake(TokenBucket * bucket, double amount) {
+  struct timespec now, pause;
+  double wait;
+  if (throttleReloadRequested) {
+    throttleReloadRequested = 0;
+    loadThrottleControlFile();
+  }
+  if (bucket->rate <= 0) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bucket->tokens += bucket->rate * ((now.tv_sec - bucket->last.tv_sec) +
+                                    (now.tv_nsec - bucket->last.tv_nsec) / 1e9);
+  if (bucket->tokens > bucket->rate) {
+    bucket->tokens = bucket->rate;
+  }
+  bucket->last = now;
+  bucket->tokens -= amount;
+  while (bucket->tokens < 0 && bucket->rate > 0) {
+    /* the debt is paid by sleeping, refill accounts for it on the next call */
+    wait = -bucket->tokens / bucket->rate;
+    pause.tv_sec = (time_t) wait;
+    pause.tv_nsec = (long) ((wait - pause.tv_sec) * 1e9);
+    if (nanosleep(&pause, NULL) == 0 || errno != EINTR) {
+      break;
+    }
+    /* interrupted: apply new limits at once and recount the debt left */
+    if (throttleReloadRequested) {
+      throttleReloadRequested = 0;
+      loadThrottleControlFile();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bucket->tokens += bucket->rate * ((now.tv_sec - bucket->last.tv_sec) +
+                                      (now.tv_nsec - bucket->last.tv_nsec) / 1e9);
+    if (bucket->tokens > bucket->rate) {
+      bucket->tokens = bucket->rate;
+    }
+    bucket->last = now;
+  }
+}
+
+/**
+ * Write a buffer within the listing write bandwidth limit
+ * @param fd
+ * @param buf
+ * @param len
+ * @return
+ */
+ssize_t writeThrottled(int fd, const char * buf, size_t len) {
+  throttleTake(&writeBucket, (double) len);
+  return (ssize_t) write(fd, buf, len);
+}
+
+/**
+ * Check the checkpoint options are usable together with the other modes
+ * @return 0 for a rejected combination
+ */
+int checkCheckpointOptions() {
+  if (resumeMode && !checkpointFileName[0]) {
+    fprintf(stderr, "Warning: -R has no effect without a checkpoint file (-k)\n");
+    resumeMode = 0;
+  }
+  if (!checkpointFileName[0]) {
+    return 1;
+  }
+  if (compareMode) {
+    fprintf(stderr, "Error: checkpoints (-k) can't be used in the compare mode\n");
+    return 0;
+  }
+  if (!singleListingMode) {
+    fprintf(stderr, "Error: checkpoints (-k) need the single listing mode\n");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Check the output options are usable together with the other modes
+ * @return 0 for a rejected combination
+ */
+int checkOutputOptions() {
+  if (diffOutputMode != DIFF_TEXT && !compareMode) {
+    fprintf(stderr, "Error: -j and -S need the compare mode (-c)\n");
+    return 0;
+  }
+  if (frontCodedListingMode && !singleListingMode) {
+    fprintf(stderr, "Error: -p needs the single listing mode\n");
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Open the checkpoint file, restoring completed directories when resuming.
+ * A new checkpoint starts with a header line describing the run
+ * @param rootPath
+ * @return 0 when the checkpoint belongs to a different run
+ */
+int openCheckpoint(const char * rootPath) {
+  char header[DIR_NAME_LENGTH];
+  int loaded = 0;
+  if (!checkpointFileName[0]) {
+    return 1;
+  }
+  if (resumeMode) {
+    loaded = loadCheckpoint(rootPath);
+    if (loaded == -1) {
+      return 0;
+    }
+  }
+  checkpointFile = fopen(checkpointFileName, loaded ? "a" : "w");
+  if (!checkpointFile) {
+    printLog(LOG_ERR, "Can't open checkpoint file", errno);
+  } else {
+    if (fstat(fileno(checkpointFile), &checkpointStat) == -1) {
+      printLog(LOG_ERR, "Can't stat checkpoint file", errno);
+    }
+    if (!loaded) {
+      formatCheckpointHeader(header, DIR_NAME_LENGTH, rootPath);
+      fprintf(checkpointFile, "%s\n", header);
+      fflush(checkpointFile);
+    }
+  }
+  lastCheckpointSync = time(NULL);
+  return 1;
+}
+
+/**
+ * Describe the options a checkpoint depends on:
+ * the root path as given and resolved, hidden files and the prefixes
+ * @param buf
+ * @param bufLen
+ * @param rootPath
+ */
+void formatCheckpointHeader(char * buf, size_t bufLen, const char * rootPath) {
+  char * resolved = realpath(rootPath, NULL);
+  snprintf(buf, bufLen, "%s hidden=%d dir=%c file=%c root=%s\t%s", CHECKPOINT_HEADER,
+           processHiddenFiles, directoryPrefix, filePrefix, rootPath, resolved ? resolved : "");
+  free(resolved);
+}
+
+/**
+ * Find out if a directory entry is the checkpoint file itself,
+ * so a checkpoint kept inside the scanned tree is not listed
+ * @param dirPath
+ * @param name
+ * @return
+ */
+int isCheckpointFile(const char * dirPath, const char * name) {
+  char itemPath[DIR_NAME_LENGTH];
+  const char * baseName = strrchr(checkpointFileName, '/');
+  struct stat sb;
+  baseName = baseName ? baseName + 1 : checkpointFileName;
+  if (!checkpointFile || strncmp(name, baseName, FILE_NAME_LENGTH)) {
+    return 0;
+  }
+  snprintf(itemPath, DIR_NAME_LENGTH, listPathFormat, dirPath, name);
+  return stat(itemPath, &sb) == 0 &&
+         sb.st_dev == checkpointStat.st_dev && sb.st_ino == checkpointStat.st_ino;
+}
+
+/**
+ * Read completed directory blocks from the checkpoint file into the single listing.
+ * The header has to match the current run. A block is only accepted with
+ * its end marker, anything after the last complete block is cut off
+ * so new blocks can be appended
+ * @param rootPath
+ * @return 1 when resumed, 0 when there is no checkpoint, -1 for a foreign one
+ */
+int loadCheckpoint(const char * rootPath) {
+  FILE * fd;
+  DirTreeNode * pending = NULL;
+  char buf[DIR_NAME_LENGTH];
+  char header[DIR_NAME_LENGTH];
+  size_t len;
+  long validOffset = 0;
+  fd = fopen(checkpointFileName, "r");
+  if (!fd) {
+    printLog(LOG_INFO, "No checkpoint to resume from", 0);
+    return 0;
+  }
+  if (!fgets(buf, DIR_NAME_LENGTH * sizeof(char), fd)) {
+    /* interrupted before the header was written */
+    fclose(fd);
+    printLog(LOG_INFO, "No checkpoint to resume from", 0);
+    return 0;
+  }
+  formatCheckpointHeader(header, DIR_NAME_LENGTH, rootPath);
+  len = strlen(buf);
+  if (len && buf[len - 1] == '\n') {
+    buf[len - 1] = 0;
+  }
+  if (strncmp(buf, header, DIR_NAME_LENGTH)) {
+    fclose(fd);
+    fprintf(stderr, "Error: checkpoint %s was not written by this run's root and options (-a, -d, -f)\n",
+            checkpointFileName);
+    return -1;
+  }
+  validOffset = ftell(fd);
+  while (fgets(buf, DIR_NAME_LENGTH * sizeof(char), fd)) {
+    len = strlen(buf);
+    if (len < 2 || buf[len - 1] != '\n') {
+      break;
+    }
+    buf[len - 1] = 0;
+    if (buf[0] == '[' && !pending && buf[len - 2] == ']') {
+      buf[len - 2] = 0;
+      pending = createTree(buf+1);
+    } else if (buf[0] == ' ' && pending && len > 4) {
+      if (pending->items) {
+        insertListingItem(pending->items, createNode(buf+3, buf[1] == directoryPrefix));
+      } else {
+        pending->items = createNode(buf+3, buf[1] == directoryPrefix);
+      }
+    } else if (!strncmp(buf, CHECKPOINT_BLOCK_END, DIR_NAME_LENGTH) && pending) {
+      addToSingleListing(pending);
+      pending = NULL;
+      resumedDirectories++;
+      validOffset = ftell(fd);
+    } else {
+      break;
+    }
+  }
+  if (pending) {
+    freeTree(pending);
+  }
+  fclose(fd);
+  if (truncate(checkpointFileName, validOffset) == -1) {
+    printLog(LOG_ERR, "Can't truncate checkpoint file", errno);
+  }
+  printLog(LOG_INFO, "Resumed from checkpoint", 0);
+  return 1;
+}
+
+/**
+ * Append a completed directory to the checkpoint file.
+ * The file is synced to disk at most every CHECKPOINT_SYNC_INTERVAL seconds
+ * @param listing
+ */
+void checkpointDirectory(DirTreeNode * listing) {
+  char path[FILE_NAME_LENGTH];
+  long bytes = 0;
+  if (!checkpointFile) {
+    return;
+  }
+  getDirTreeNodePath(listing, path, FILE_NAME_LENGTH);
+  bytes += fprintf(checkpointFile, "[%s]\n", path);
+  bytes += writeCheckpointItems(checkpointFile, listing->items);
+  bytes += fprintf(checkpointFile, "%s\n", CHECKPOINT_BLOCK_END);
+  /* checkpoint writes share the listing write bandwidth limit */
+  throttleTake(&writeBucket, (double) bytes);
+  if (time(NULL) - lastCheckpointSync >= CHECKPOINT_SYNC_INTERVAL) {
+    fflush(checkpointFile);
+    fsync(fileno(checkpointFile));
+    lastCheckpointSync = time(NULL);
+  }
+}
+
+/**
+ * Write a directory's items into the checkpoint file
+ * @param fd
+ * @param node
+ * @return number of bytes written
+ */
+long writeCheckpointItems(FILE * fd, ListingNode * node) {
+  long bytes = 0;
+  if (node) {
+    if (node->left) {
+      bytes += writeCheckpointItems(fd, node->left);
+    }
+    bytes += fprintf(fd, " %c:%s\n", node->itemType, node->fileName);
+    if (node->right) {
+      bytes += writeCheckpointItems(fd, node->right);
+    }
+  }
+  return bytes;
+}
+
+/**
+ * Close the checkpoint file. It is removed once the snapshot is completed
+ * @param completed
+ */
+void closeCheckpoint(int completed) {
+  if (checkpointFile) {
+    fclose(checkpointFile);
+    checkpointFile = NULL;
+    if (completed) {
+      unlink(checkpointFileName);
+    }
+  }
+}
+
 /**
  * Insert an item in the directory's listing
  * @param tree
@@ -141,13 +718,16 @@ void printLog(enum LogType type, const char * msg, int errCode) {
 int writeListing(DirTreeNode * listing) {
   int fd;
   ssize_t bytesWritten = 0;
-  char buf[FILE_NAME_LENGTH];
+  char buf[DIR_NAME_LENGTH];
+  char dirPath[FILE_NAME_LENGTH];
   char listingFilePath[DIR_NAME_LENGTH]; /* Full path to a listing file */
   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
 
+  getDirTreeNodePath(listing, dirPath, FILE_NAME_LENGTH);
+
   /* prepare and fill the full path to the listing file */
   memset(listingFilePath, 0, sizeof(char) * (DIR_NAME_LENGTH - 1));
-  snprintf(listingFilePath, DIR_NAME_LENGTH, listPathFormat, listing->name, listingFileName);
+  snprintf(listingFilePath, DIR_NAME_LENGTH, listPathFormat, dirPath, listingFileName);
 
 #ifdef O_NOFOLLOW
   fd = open(listingFilePath, O_WRONLY | O_CREAT | O_NOFOLLOW | O_TRUNC, mode);
@@ -155,16 +735,16 @@ int writeListing(DirTreeNode * listing) {
   fd = open(listingFilePath, O_WRONLY | O_CREAT | O_TRUNC, mode);
 #endif
   if (fd != -1) {
-    memset(buf, 0, FILE_NAME_LENGTH);
-    snprintf(buf, FILE_NAME_LENGTH-1, "[%s]", listing->name);
+    memset(buf, 0, DIR_NAME_LENGTH);
+    snprintf(buf, DIR_NAME_LENGTH-1, "[%s]", dirPath);
     buf[strlen(buf)] = '\n'; /* add a new line to each line */
-    bytesWritten = (ssize_t) write(fd, buf, sizeof(char) * strlen(buf));
+    bytesWritten = writeThrottled(fd, buf, sizeof(char) * strlen(buf));
     if (bytesWritten != strlen(buf)) {
       printLog(LOG_ERR, "Can't write buffer", errno);
     }
     writeListingNodeItem(fd, listing->items);
     close(fd);
-    printLog(LOG_DONE, listing->name, 0); /* show a completion message */
+    printLog(LOG_DONE, dirPath, 0); /* show a completion message */
     return 1;
   } else {
     printLog(LOG_ERR, "Can't write listing", errno);
@@ -222,6 +802,97 @@ void setSeparateListingMode() {
   singleListingMode = 0;
 }
 
+/**
+ * Set inode order mode flag
+ */
+void setInodeOrderMode() {
+  inodeOrderMode = 1;
+}
+
+/**
+ * Set idle I/O priority flag
+ */
+void setIdlePriorityMode() {
+  idlePriorityMode = 1;
+}
+
+/**
+ * Limit the number of directories processed per second
+ */
+int setDirRateLimit(const char * rate) {
+  double value;
+  if (!parseRate(rate, &value)) {
+    return 0;
+  }
+  setBucketRate(&dirBucket, value);
+  return 1;
+}
+
+/**
+ * Limit the number of directory entries processed per second
+ */
+int setEntryRateLimit(const char * rate) {
+  double value;
+  if (!parseRate(rate, &value)) {
+    return 0;
+  }
+  setBucketRate(&entryBucket, value);
+  return 1;
+}
+
+/**
+ * Limit the listing write bandwidth in bytes per second
+ */
+int setWriteRateLimit(const char * rate) {
+  double value;
+  if (!parseRate(rate, &value)) {
+    return 0;
+  }
+  setBucketRate(&writeBucket, value);
+  return 1;
+}
+
+/**
+ * Set a throttle control file re-read on SIGHUP
+ */
+void setThrottleControlFile(const char * fileName) {
+  if (fileName) {
+    strncpy(throttleControlFile, fileName, FILE_NAME_LENGTH - 1);
+    throttleControlFile[FILE_NAME_LENGTH - 1] = 0; /* set an EOL */
+  }
+}
+
+/**
+ * Set a checkpoint file for completed directories
+ */
+void setCheckpointFileName(const char * fileName) {
+  if (fileName) {
+    strncpy(checkpointFileName, fileName, FILE_NAME_LENGTH - 1);
+    checkpointFileName[FILE_NAME_LENGTH - 1] = 0; /* set an EOL */
+  }
+}
+
+/**
+ * Set resume mode flag
+ */
+void setResumeMode() {
+  resumeMode = 1;
+}
+
+/**
+ * Set the compare mode output format
+ */
+void setDiffOutputMode(enum DiffOutput mode) {
+  diffOutputMode = mode;
+}
+
+/**
+ * Set front-coded (prefix-compressed) single listing flag
+ */
+void setFrontCodedListingMode() {
+  frontCodedListingMode = 1;
+}
+
 /**
  * Add a directory to the single listing
  */
@@ -240,22 +911,34 @@ void addToSingleListing(DirTreeNode * listing) {
 int takeSnapshot(const char * dirPath) {
   int ret = 0;
   char cwd[DIR_NAME_LENGTH];
-      /* process a directory */
-  processDirectory(dirPath);
+  if (!initThrottling()) {
+    return 1;
+  }
+  if (!openCheckpoint(dirPath)) {
+    return 1;
+  }
+  /* process a directory */
+  processDirectory(dirPath, NULL);
   if (singleListingMode) {
     getcwd(cwd, DIR_NAME_LENGTH);
     if (compareMode) {
       DirTreeNode * prevListing = readLilsting(cwd, listingFileName);
-      compareTrees(prevListing, singleListing, 1);
-      compareTrees(singleListing, prevListing, 0);
+      if (!compareListings(prevListing, singleListing, cwd)) {
+        ret = 1;
+      }
       freeTree(prevListing);
     } else {
       /* write the single listing */
       ret = writeSingleListing(singleListing);
     }
+    closeCheckpoint(ret == 0);
     /* free all elements */
     freeTree(singleListing);
   }
+  if (compareMode && diffOutputMode != DIFF_TEXT) {
+    writeDiffSummary();
+    diffFlush();
+  }
   return ret;
 }
 
@@ -264,6 +947,7 @@ int takeSnapshot(const char * dirPath) {
  */
 int writeSingleListing(DirTreeNode * listing) {
   int fd;
+  char prevPath[FILE_NAME_LENGTH]; /* Previous header path for the front coding */
   printLog(LOG_INFO, "Single listing write!", 0);
   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
 #ifdef O_NOFOLLOW
@@ -272,7 +956,8 @@ int writeSingleListing(DirTreeNode * listing) {
   fd = open(listingFileName, O_WRONLY | O_CREAT | O_TRUNC, mode);
 #endif
   if (fd != -1) {
-    writeListingNode(fd, listing);
+    memset(prevPath, 0, FILE_NAME_LENGTH);
+    writeListingNode(fd, listing, frontCodedListingMode ? prevPath : NULL);
     close(fd);
     printLog(LOG_INFO, "Single listing complete!", 0); /* show a completion message */
     return 0;
@@ -283,28 +968,39 @@ int writeSingleListing(DirTreeNode * listing) {
 }
 
 /**
- * Write a directoty node into a file
+ * Write a directoty node into a file.
+ * With a prevPath buffer the header is front-coded as "{N:suffix}",
+ * where N is the number of bytes shared with the previous header path
  * @param fd
  * @param node
+ * @param prevPath (NULL for plain "[path]" headers)
  * @return
  */
-int writeListingNode(int fd, DirTreeNode * node) {
-  int bLen;
+int writeListingNode(int fd, DirTreeNode * node, char * prevPath) {
+  int bLen, shared;
   ssize_t bytesWritten = 0;
+  char path[FILE_NAME_LENGTH];
   if (fd != -1) {
     if (node->left) {
-      writeListingNode(fd, node->left);
+      writeListingNode(fd, node->left, prevPath);
     }
-    char *buf = (char *)malloc(FILE_NAME_LENGTH * sizeof(char));
-    bLen = snprintf(buf, FILE_NAME_LENGTH, "[%s]\n", node->name);
-    bytesWritten = (ssize_t) write(fd, buf, sizeof(char) * bLen);
+    char *buf = (char *)malloc(DIR_NAME_LENGTH * sizeof(char));
+    getDirTreeNodePath(node, path, FILE_NAME_LENGTH);
+    if (prevPath) {
+      shared = sharedPrefixLength(prevPath, path);
+      bLen = snprintf(buf, DIR_NAME_LENGTH, "{%d:%s}\n", shared, path + shared);
+      strncpy(prevPath, path, FILE_NAME_LENGTH);
+    } else {
+      bLen = snprintf(buf, DIR_NAME_LENGTH, "[%s]\n", path);
+    }
+    bytesWritten = writeThrottled(fd, buf, sizeof(char) * bLen);
     if (bytesWritten != bLen) {
       printLog(LOG_ERR, "Can't write buffer", errno);
     }
     writeListingNodeItem(fd, node->items);
     free(buf);
     if (node->right) {
-      writeListingNode(fd, node->right);
+      writeListingNode(fd, node->right, prevPath);
     }
   }
   return 0;
@@ -325,7 +1021,7 @@ int writeListingNodeItem(int fd, ListingNode * node) {
     }
     char *buf = (char *)malloc(FILE_NAME_LENGTH * sizeof(char));
     bLen = snprintf(buf, FILE_NAME_LENGTH, " %c:%s\n", node->itemType, node->fileName);
-    bytesWritten = (ssize_t) write(fd, buf, sizeof(char) * bLen);
+    bytesWritten = writeThrottled(fd, buf, sizeof(char) * bLen);
     if (bytesWritten != bLen) {
       printLog(LOG_ERR, "Can't write buffer", errno);
     }
@@ -370,6 +1066,8 @@ DirTreeNode * createTree(const char * fileName) {
   DirTreeNode * node = (DirTreeNode *)malloc(sizeof(DirTreeNode));
 
   node->items = NULL;
+  node->parent = NULL;
+  node->depth = 0;
   node->left = NULL;
   node->right = NULL;
   node->name = strndup(fileName, FILE_NAME_LENGTH - 1);
@@ -377,20 +1075,176 @@ DirTreeNode * createTree(const char * fileName) {
   return node;
 }
 
+/**
+ * Creates a node for a subdirectory of the parent.
+ * Only the last path component is stored, the rest comes from the parent
+ * @param parent
+ * @param baseName
+ * @return DirTreeNode*
+ */
+DirTreeNode * createChildTree(DirTreeNode * parent, const char * baseName) {
+  DirTreeNode * node = createTree(baseName);
+  node->parent = parent;
+  node->depth = parent->depth + 1;
+
+  return node;
+}
+
+/**
+ * Build the full path of a directory node into a buffer
+ * @param node
+ * @param buf
+ * @param bufLen
+ * @return length of the path
+ */
+int getDirTreeNodePath(DirTreeNode * node, char * buf, int bufLen) {
+  int len;
+  if (node->parent) {
+    len = getDirTreeNodePath(node->parent, buf, bufLen);
+    len += snprintf(buf + len, bufLen - len, "/%s", node->name);
+  } else {
+    len = snprintf(buf, bufLen, "%s", node->name);
+  }
+  return len < bufLen ? len : bufLen - 1;
+}
+
+/**
+ * Compare a directory node's full path with a path string like strcmp does,
+ * walking the parent chain instead of building the node's path
+ * @param node
+ * @param path
+ * @return
+ */
+int compareDirTreeNodePath(DirTreeNode * node, const char * path) {
+  int result = compareDirTreeNodePrefix(node, &path);
+  if (result) {
+    return result;
+  }
+  return *path ? -1 : 0;
+}
+
+/**
+ * Compare a directory node's path with the beginning of a path string.
+ * On a match the string pointer is moved past the compared part
+ * @param node
+ * @param path
+ * @return
+ */
+int compareDirTreeNodePrefix(DirTreeNode * node, const char ** path) {
+  const unsigned char * name = (const unsigned char *) node->name;
+  const unsigned char * cur;
+  int result;
+  if (node->parent) {
+    result = compareDirTreeNodePrefix(node->parent, path);
+    if (result) {
+      return result;
+    }
+    if (**path != '/') {
+      return '/' - (unsigned char) **path;
+    }
+    (*path)++;
+  }
+  cur = (const unsigned char *) *path;
+  while (*name && *name == *cur) {
+    name++;
+    cur++;
+  }
+  *path = (const char *) cur;
+  return *name ? *name - *cur : 0;
+}
+
+/**
+ * Compare full paths of two directory nodes like strcmp does.
+ * Nodes under a common parent only compare the components below it
+ * @param a
+ * @param b
+ * @return
+ */
+int compareDirTreeNodes(DirTreeNode * a, DirTreeNode * b) {
+  DirTreeNode * x = a;
+  DirTreeNode * y = b;
+  char path[FILE_NAME_LENGTH];
+  int depthX = a->depth;
+  int depthY = b->depth;
+  int liftedX = 0, liftedY = 0, result = 0;
+  for (; depthX > depthY; depthX--, liftedX = 1) {
+    x = x->parent;
+  }
+  for (; depthY > depthX; depthY--, liftedY = 1) {
+    y = y->parent;
+  }
+  if (x == y) {
+    /* one node is an ancestor of the other, its path is a prefix */
+    return liftedX - liftedY;
+  }
+  while (x->parent && x->parent != y->parent) {
+    x = x->parent;
+    y = y->parent;
+    liftedX = liftedY = 1;
+  }
+  if (x->parent) {
+    /* a component ends with '/' when the path goes on below it */
+    result = compareComponents(x->name, liftedX ? '/' : 0, y->name, liftedY ? '/' : 0);
+  }
+  if (!result) {
+    /* different top nodes */
+    getDirTreeNodePath(a, path, FILE_NAME_LENGTH);
+    result = -compareDirTreeNodePath(b, path);
+  }
+  return result;
+}
+
+/**
+ * Compare path components, each followed by its terminating character
+ * @param a
+ * @param endA
+ * @param b
+ * @param endB
+ * @return
+ */
+int compareComponents(const char * a, int endA, const char * b, int endB) {
+  size_t lenA = strlen(a);
+  size_t lenB = strlen(b);
+  int result = memcmp(a, b, lenA < lenB ? lenA : lenB);
+  if (result || lenA == lenB) {
+    return result ? result : endA - endB;
+  }
+  if (lenA < lenB) {
+    return endA - (unsigned char) b[lenA];
+  }
+  return (unsigned char) a[lenB] - endB;
+}
+
+/**
+ * Count the leading bytes two strings have in common
+ * @param a
+ * @param b
+ * @return
+ */
+int sharedPrefixLength(const char * a, const char * b) {
+  int len = 0;
+  while (a[len] && a[len] == b[len]) {
+    len++;
+  }
+  return len;
+}
+
 /**
  * Insert a directory node in the tree
  * @param tree
  * @param node
  */
 void insertNode(DirTreeNode * tree, DirTreeNode * node) {
+  int result;
   if (tree && node->name) {
-    if (strncmp(node->name, tree->name, FILE_NAME_LENGTH - 1) < 0) {
+    result = compareDirTreeNodes(node, tree);
+    if (result < 0) {
       if (tree->left) {
         insertNode(tree->left, node);
       } else {
         tree->left = node;
       }
-    } else if (strncmp(node->name, tree->name, FILE_NAME_LENGTH - 1) > 0) {
+    } else if (result > 0) {
       if (tree->right) {
         insertNode(tree->right, node);
       } else {
@@ -475,7 +1329,8 @@ void setProcessHiddenFiles() {
 }
 
 /**
- * Read a directory listing for a file
+ * Read a directory listing for a file.
+ * Both plain "[path]" and front-coded "{N:suffix}" headers are accepted
  * @param dirPath
  * @param fileName
  * @return
@@ -483,9 +1338,16 @@ void setProcessHiddenFiles() {
 DirTreeNode * readLilsting(const char * dirPath, const char *fileName) {
   DirTreeNode * tree = NULL;
   DirTreeNode * cur = NULL;
+  DirTreeNode * last = NULL; /* Greatest directory read so far */
   int isDir = 0;
+  long shared = 0;
+  char * suffix;
   FILE * fd;
   char buf[FILE_NAME_LENGTH];
+  char prevPath[FILE_NAME_LENGTH]; /* Last decoded header path */
+  HeaderStack parents; /* Directories the last header is nested in */
+  memset(prevPath, 0, FILE_NAME_LENGTH);
+  parents.depth = 0;
   char listingPath[DIR_NAME_LENGTH]; /* Full path to a next directory */
   memset(listingPath, 0, sizeof(char) * DIR_NAME_LENGTH);
   snprintf(listingPath, sizeof(char) * (DIR_NAME_LENGTH - 1), listPathFormat, dirPath, fileName);
@@ -494,11 +1356,18 @@ DirTreeNode * readLilsting(const char * dirPath, const char *fileName) {
     while (fgets(buf, FILE_NAME_LENGTH * sizeof(char), fd)) {
       if (buf[0] == '[') {
         buf[strlen(buf) - 2] = 0;
-        if (!tree) {
-          tree = cur = createTree(buf+1);
+        shared = sharedPrefixLength(prevPath, buf+1);
+        strncpy(prevPath, buf+1, FILE_NAME_LENGTH - 1);
+        cur = addListingDirectory(&tree, &last, &parents, prevPath, shared);
+      } else if (buf[0] == '{') {
+        buf[strlen(buf) - 2] = 0;
+        shared = strtol(buf+1, &suffix, 10);
+        if (*suffix == ':' && shared >= 0 && shared <= (long) strlen(prevPath)) {
+          snprintf(prevPath + shared, FILE_NAME_LENGTH - shared, "%s", suffix + 1);
+          cur = addListingDirectory(&tree, &last, &parents, prevPath, shared);
         } else {
-          cur = createTree(buf+1);
-          insertNode(tree, cur);
+          printLog(LOG_ERR, "Malformed listing header", EINVAL);
+          cur = NULL;
         }
       } else {
         buf[strlen(buf) - 1] = 0;
@@ -514,9 +1383,130 @@ DirTreeNode * readLilsting(const char * dirPath, const char *fileName) {
     }
     fclose(fd);
   }
+  return balanceTree(tree);
+}
+
+/**
+ * Add a directory read from a listing to the tree.
+ * Listings are sorted, so a parent directory comes before its children
+ * and is still on the stack of the previous header's ancestors.
+ * A directory whose parent is found there is linked to it
+ * and keeps only its last path component
+ * @param tree
+ * @param last (greatest node so far, a sorted listing is appended after it)
+ * @param parents
+ * @param dirPath
+ * @param shared (bytes shared with the previous header path)
+ * @return the new node
+ */
+DirTreeNode * addListingDirectory(DirTreeNode ** tree, DirTreeNode ** last, HeaderStack * parents, const char * dirPath, int shared) {
+  DirTreeNode * node = NULL;
+  DirTreeNode * parent = NULL;
+  int len, top;
+  const char * baseName = strrchr(dirPath, '/');
+  /* drop the previous ancestors which are not a prefix of this path */
+  while (parents->depth > 0) {
+    len = parents->pathLength[parents->depth - 1];
+    if (len <= shared && dirPath[len] == '/') {
+      break;
+    }
+    parents->depth--;
+  }
+  top = parents->depth - 1;
+  if (top >= 0 && baseName == dirPath + parents->pathLength[top]) {
+    parent = parents->nodes[top];
+  }
+  if (parent) {
+    node = createChildTree(parent, baseName + 1);
+  } else {
+    node = createTree(dirPath);
+  }
+  if (!*tree) {
+    *tree = *last = node;
+  } else if (compareDirTreeNodePath(*last, dirPath) < 0) {
+    (*last)->right = node;
+    *last = node;
+  } else {
+    insertNode(*tree, node);
+  }
+  if (parents->depth < FILE_NAME_LENGTH) {
+    parents->nodes[parents->depth] = node;
+    parents->pathLength[parents->depth] = (int) strlen(dirPath);
+    parents->depth++;
+  }
+  return node;
+}
+
+/**
+ * Rebuild a tree as a balanced one.
+ * A sorted listing read back otherwise turns into a list
+ * @param tree
+ * @return the new root
+ */
+DirTreeNode * balanceTree(DirTreeNode * tree) {
+  DirTreeNode ** nodes;
+  int count = countTreeNodes(tree);
+  if (count < 3) {
+    return tree;
+  }
+  nodes = (DirTreeNode **)malloc(count * sizeof(DirTreeNode *));
+  if (!nodes) {
+    return tree;
+  }
+  flattenTree(tree, nodes, 0);
+  tree = buildBalancedTree(nodes, 0, count - 1);
+  free(nodes);
   return tree;
 }
 
+/**
+ * Count the nodes of a tree
+ * @param tree
+ * @return
+ */
+int countTreeNodes(DirTreeNode * tree) {
+  int count = 0;
+  while (tree) {
+    count += 1 + countTreeNodes(tree->left);
+    tree = tree->right;
+  }
+  return count;
+}
+
+/**
+ * Store the tree's nodes in order into an array
+ * @param tree
+ * @param nodes
+ * @param pos
+ * @return the next free position
+ */
+int flattenTree(DirTreeNode * tree, DirTreeNode ** nodes, int pos) {
+  while (tree) {
+    pos = flattenTree(tree->left, nodes, pos);
+    nodes[pos++] = tree;
+    tree = tree->right;
+  }
+  return pos;
+}
+
+/**
+ * Link sorted nodes into a balanced tree
+ * @param nodes
+ * @param from
+ * @param to
+ * @return the root
+ */
+DirTreeNode * buildBalancedTree(DirTreeNode ** nodes, int from, int to) {
+  int mid;
+  if (from > to) {
+    return NULL;
+  }
+  mid = from + (to - from) / 2;
+  nodes[mid]->left = buildBalancedTree(nodes, from, mid - 1);
+  nodes[mid]->right = buildBalancedTree(nodes, mid + 1, to);
+  return nodes[mid];
+}
+
 /**
  * Compare trees with a given direction
  * @param prevTree
@@ -525,27 +1515,38 @@ DirTreeNode * readLilsting(const char * dirPath, const char *fileName) {
  */
 void compareTrees(DirTreeNode * prevTree, DirTreeNode * curTree, const int direction) {
   char buf[DIR_NAME_LENGTH];
+  char curPath[FILE_NAME_LENGTH];
   if (prevTree && curTree) {
-    if (curTree->left) {
+    if (!direction) {
+      /* a listing read back is balanced, walk it in descending order
+         to print it the way a list-shaped tree was printed */
+      if (curTree->right) {
+        compareTrees(prevTree, curTree->right, direction);
+      }
+    } else if (curTree->left) {
       compareTrees(prevTree, curTree->left, direction);
     }
-    if (curTree->right) {
+    if (direction && curTree->right) {
       compareTrees(prevTree, curTree->right, direction);
     }
-    DirTreeNode * item = findDirectory(prevTree, curTree->name);
+    getDirTreeNodePath(curTree, curPath, FILE_NAME_LENGTH);
+    DirTreeNode * item = findDirectory(prevTree, curPath);
     if (item) {
-      printf("Comparing %s\n", curTree->name);
+      printf("Comparing %s\n", curPath);
       compareItemsInDirectory(item->items, curTree->items, direction);
       printf("...done\n");
     } else {
       if (direction) {
-        snprintf(buf, sizeof(char) * (DIR_NAME_LENGTH - 1), "+++ [%s]", curTree->name);
+        snprintf(buf, sizeof(char) * (DIR_NAME_LENGTH - 1), "+++ [%s]", curPath);
       } else {
-        snprintf(buf, sizeof(char) * (DIR_NAME_LENGTH - 1), "--- [%s]", curTree->name);
+        snprintf(buf, sizeof(char) * (DIR_NAME_LENGTH - 1), "--- [%s]", curPath);
       }
       printf("%s\n", buf);
       writeDirDifference(curTree->items, direction);
     }
+    if (!direction && curTree->left) {
+      compareTrees(prevTree, curTree->left, direction);
+    }
   }
 }
 
@@ -556,11 +1557,13 @@ void compareTrees(DirTreeNode * prevTree, DirTreeNode * curTree, const int direc
  * @return
  */
 DirTreeNode * findDirectory(DirTreeNode * tree, const char * dirPath) {
+  int result;
   if (tree && dirPath) {
-    if (!strncmp(tree->name, dirPath, FILE_NAME_LENGTH)) {
+    result = compareDirTreeNodePath(tree, dirPath);
+    if (!result) {
       return tree;
     }
-    if (strncmp(tree->name, dirPath, FILE_NAME_LENGTH) > 0) {
+    if (result > 0) {
       return findDirectory(tree->left, dirPath);
     } else {
       return findDirectory(tree->right, dirPath);
@@ -639,4 +1642,340 @@ void writeDirDifference(ListingNode * listing, const int newItems) {
       printf(" --- %c:%s\n", listing->itemType, listing->fileName);
     }
   }
-}
\ No newline at end of file
+}
+
+/**
+ * Compare a previous listing with the current one in the chosen output format.
+ * A missing single listing is reported and counted instead of being
+ * compared as empty, so a wrong listing name doesn't look like a new tree.
+ * In the separate listing mode a directory without a listing is a new one
+ * @param prevTree
+ * @param curTree
+ * @param dirPath (directory the previous listing was read from)
+ * @return 0 when there is no previous single listing
+ */
+int compareListings(DirTreeNode * prevTree, DirTreeNode * curTree, const char * dirPath) {
+  if (!prevTree) {
+    if (singleListingMode) {
+      fprintf(stderr, "Error: can't read the previous listing %s/%s\n", dirPath, listingFileName);
+      diffSummary.missingListings++;
+      return 0;
+    }
+    if (diffOutputMode != DIFF_TEXT) {
+      diffTrees(NULL, curTree, 1);
+    }
+    return 1;
+  }
+  if (diffOutputMode == DIFF_TEXT) {
+    compareTrees(prevTree, curTree, 1);
+    compareTrees(curTree, prevTree, 0);
+  } else {
+    diffTrees(prevTree, curTree, 1);
+    diffTrees(curTree, prevTree, 0);
+  }
+  return 1;
+}
+
+/**
+ * Stream the differences of the tree's directories as NDJSON records.
+ * The forward pass reports added and changed directories with both counts,
+ * the backward pass only reports removed ones.
+ * A directory record follows the records of its entries
+ * @param otherTree
+ * @param tree
+ * @param direction
+ */
+void diffTrees(DirTreeNode * otherTree, DirTreeNode * tree, const int direction) {
+  char path[FILE_NAME_LENGTH];
+  long added, removed;
+  if (tree) {
+    if (tree->left) {
+      diffTrees(otherTree, tree->left, direction);
+    }
+    getDirTreeNodePath(tree, path, FILE_NAME_LENGTH);
+    DirTreeNode * item = findDirectory(otherTree, path);
+    if (item && direction) {
+      added = diffItems(item->items, tree->items, path, '+');
+      removed = diffItems(tree->items, item->items, path, '-');
+      if (added || removed) {
+        diffSummary.dirsChanged++;
+        writeDiffDirectory("changed", path, added, removed);
+      }
+    } else if (!item && direction) {
+      added = diffItems(NULL, tree->items, path, '+');
+      diffSummary.dirsAdded++;
+      writeDiffDirectory("added", path, added, 0);
+    } else if (!item) {
+      removed = diffItems(NULL, tree->items, path, '-');
+      diffSummary.dirsRemoved++;
+      writeDiffDirectory("removed", path, 0, removed);
+    }
+    if (tree->right) {
+      diffTrees(otherTree, tree->right, direction);
+    }
+  }
+}
+
+/**
+ * Count and stream the items missing from the other directory
+ * @param otherItems
+ * @param items
+ * @param dirPath
+ * @param op ('+' for added, '-' for removed items)
+ * @return number of missing items
+ */
+long diffItems(ListingNode * otherItems, ListingNode * items, const char * dirPath, const char op) {
+  long count = 0;
+  if (items) {
+    count += diffItems(otherItems, items->left, dirPath, op);
+    if (!findItemInDirectory(otherItems, items)) {
+      count++;
+      writeDiffEntry(op, dirPath, items);
+    }
+    count += diffItems(otherItems, items->right, dirPath, op);
+  }
+  return count;
+}
+
+/**
+ * Write an added or removed entry record
+ * @param op
+ * @param dirPath
+ * @param item
+ */
+void writeDiffEntry(const char op, const char * dirPath, ListingNode * item) {
+  char buf[FILE_NAME_LENGTH];
+  if (op == '+') {
+    diffSummary.entriesAdded++;
+  } else {
+    diffSummary.entriesRemoved++;
+  }
+  if (diffOutputMode != DIFF_JSON) {
+    return;
+  }
+  snprintf(buf, FILE_NAME_LENGTH, "{\"type\":\"entry\",\"op\":\"%c\",\"kind\":\"%s\"", op,
+           item->itemType == directoryPrefix ? "dir" : "file");
+  diffWriteString(buf);
+  diffWriteJsonField("dir", dirPath);
+  diffWriteJsonField("name", item->fileName);
+  diffWriteString("}\n");
+}
+
+/**
+ * Write a per-directory record with the added and removed entry counts
+ * @param status ("added", "removed" or "changed")
+ * @param dirPath
+ * @param added
+ * @param removed
+ */
+void writeDiffDirectory(const char * status, const char * dirPath, long added, long removed) {
+  char buf[FILE_NAME_LENGTH];
+  if (diffOutputMode != DIFF_JSON) {
+    return;
+  }
+  snprintf(buf, FILE_NAME_LENGTH, "{\"type\":\"dir\",\"status\":\"%s\"", status);
+  diffWriteString(buf);
+  diffWriteJsonField("path", dirPath);
+  snprintf(buf, FILE_NAME_LENGTH, ",\"added\":%ld,\"removed\":%ld}\n", added, removed);
+  diffWriteString(buf);
+}
+
+/**
+ * Write the final summary record
+ */
+void writeDiffSummary() {
+  char buf[DIR_NAME_LENGTH];
+  snprintf(buf, DIR_NAME_LENGTH,
+           "{\"type\":\"summary\",\"dirs_added\":%ld,\"dirs_removed\":%ld,\"dirs_changed\":%ld,"
+           "\"entries_added\":%ld,\"entries_removed\":%ld,\"missing_listings\":%ld}\n",
+           diffSummary.dirsAdded, diffSummary.dirsRemoved, diffSummary.dirsChanged,
+           diffSummary.entriesAdded, diffSummary.entriesRemoved, diffSummary.missingListings);
+  diffWriteString(buf);
+}
+
+/**
+ * Append bytes to the diff output buffer, flushing it when full
+ * @param buf
+ * @param len
+ */
+void diffWrite(const char * buf, size_t len) {
+  size_t chunk;
+  while (len) {
+    if (diffBufferLen == DIFF_BUFFER_SIZE) {
+      diffFlush();
+    }
+    chunk = DIFF_BUFFER_SIZE - diffBufferLen;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(diffBuffer + diffBufferLen, buf, chunk);
+    diffBufferLen += chunk;
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+/**
+ * Append a string to the diff output buffer
+ * @param str
+ */
+void diffWriteString(const char * str) {
+  diffWrite(str, strlen(str));
+}
+
+/**
+ * Append a ",key:value" pair to the diff output buffer.
+ * A value which is not valid UTF-8 is also written as "key_base64"
+ * to keep its exact bytes
+ * @param key
+ * @param value
+ */
+void diffWriteJsonField(const char * key, const char * value) {
+  diffWriteString(",\"");
+  diffWriteString(key);
+  diffWriteString("\":");
+  diffWriteJsonString(value);
+  if (!isValidUtf8(value)) {
+    diffWriteString(",\"");
+    diffWriteString(key);
+    diffWriteString("_base64\":\"");
+    diffWriteBase64(value);
+    diffWriteString("\"");
+  }
+}
+
+/**
+ * Append a string encoded in base64 to the diff output buffer
+ * @param str
+ */
+void diffWriteBase64(const char * str) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const unsigned char * cur = (const unsigned char *) str;
+  size_t len = strlen(str);
+  char out[4];
+  unsigned long triple;
+  for (; len > 0; cur += 3, len = len > 3 ? len - 3 : 0) {
+    triple = (unsigned long) cur[0] << 16;
+    if (len > 1) {
+      triple |= (unsigned long) cur[1] << 8;
+    }
+    if (len > 2) {
+      triple |= cur[2];
+    }
+    out[0] = alphabet[(triple >> 18) & 0x3f];
+    out[1] = alphabet[(triple >> 12) & 0x3f];
+    out[2] = len > 1 ? alphabet[(triple >> 6) & 0x3f] : '=';
+    out[3] = len > 2 ? alphabet[triple & 0x3f] : '=';
+    diffWrite(out, 4);
+  }
+}
+
+/**
+ * Length of a valid UTF-8 sequence at the position.
+ * Overlong forms, surrogates and code points above U+10FFFF are invalid
+ * @param str
+ * @return the length or 0 for an invalid sequence
+ */
+int utf8SequenceLength(const unsigned char * str) {
+  int len, i;
+  unsigned long codePoint;
+  if (str[0] < 0x80) {
+    return 1;
+  } else if ((str[0] & 0xe0) == 0xc0) {
+    len = 2;
+    codePoint = str[0] & 0x1f;
+  } else if ((str[0] & 0xf0) == 0xe0) {
+    len = 3;
+    codePoint = str[0] & 0x0f;
+  } else if ((str[0] & 0xf8) == 0xf0) {
+    len = 4;
+    codePoint = str[0] & 0x07;
+  } else {
+    return 0;
+  }
+  for (i = 1; i < len; i++) {
+    if ((str[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    codePoint = (codePoint << 6) | (str[i] & 0x3f);
+  }
+  if ((len == 2 && codePoint < 0x80) || (len == 3 && codePoint < 0x800) ||
+      (len == 4 && codePoint < 0x10000) || codePoint > 0x10ffff ||
+      (codePoint >= 0xd800 && codePoint <= 0xdfff)) {
+    return 0;
+  }
+  return len;
+}
+
+/**
+ * Find out if a string is valid UTF-8
+ * @param str
+ * @return
+ */
+int isValidUtf8(const char * str) {
+  const unsigned char * cur = (const unsigned char *) str;
+  int len;
+  while (*cur) {
+    if (!(len = utf8SequenceLength(cur))) {
+      return 0;
+    }
+    cur += len;
+  }
+  return 1;
+}
+
+/**
+ * Append a quoted and escaped JSON string to the diff output buffer.
+ * Bytes which are not valid UTF-8 are replaced with U+FFFD
+ * @param str
+ */
+void diffWriteJsonString(const char * str) {
+  char escaped[8];
+  const char * start = str;
+  int len;
+  diffWrite("\"", 1);
+  for (; *str; str++) {
+    if ((unsigned char) *str >= 0x80) {
+      len = utf8SequenceLength((const unsigned char *) str);
+      if (len) {
+        str += len - 1; /* keep a valid sequence as it is */
+        continue;
+      }
+      diffWrite(start, str - start);
+      diffWriteString("\\ufffd");
+      start = str + 1;
+    } else if (*str == '"' || *str == '\\' || (unsigned char) *str < 0x20) {
+      diffWrite(start, str - start);
+      if (*str == '"' || *str == '\\') {
+        snprintf(escaped, sizeof(escaped), "\\%c", *str);
+      } else {
+        snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char) *str);
+      }
+      diffWriteString(escaped);
+      start = str + 1;
+    }
+  }
+  diffWrite(start, str - start);
+  diffWrite("\"", 1);
+}
+
+/**
+ * Write the buffered diff output to stdout
+ */
+void diffFlush() {
+  ssize_t written;
+  size_t offset = 0;
+  fflush(stdout); /* keep the order with printf-ed log lines */
+  while (offset < diffBufferLen) {
+    written = write(STDOUT_FILENO, diffBuffer + offset, diffBufferLen - offset);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printLog(LOG_ERR, "Can't write diff output", errno);
+      break;
+    }
+    offset += (size_t) written;
+  }
+  diffBufferLen = 0;
+}
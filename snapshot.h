@@ -9,10 +9,23 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #define DIR_NAME_LENGTH 1024
 #define FILE_NAME_LENGTH 256
 #define LST_FILE_NAME "dir.lst"
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IDLE_NICE_LEVEL 19
+#define CHECKPOINT_SYNC_INTERVAL 5 /* seconds between checkpoint fsync calls */
+#define CHECKPOINT_BLOCK_END "="
+#define CHECKPOINT_HEADER "#cdir_snapshot checkpoint"
+#define DIFF_BUFFER_SIZE 65536
 
 extern char listPathFormat[];
 typedef struct _ListingNode {
@@ -22,8 +35,39 @@ typedef struct _ListingNode {
   struct _ListingNode * right;
 } ListingNode;
 
+typedef struct _DiffSummary {
+  long dirsAdded;
+  long dirsRemoved;
+  long dirsChanged;
+  long entriesAdded;
+  long entriesRemoved;
+  long missingListings;
+} DiffSummary;
+
+typedef struct _TokenBucket {
+  double rate; /* tokens per second, 0 means unlimited */
+  double tokens;
+  struct timespec last;
+} TokenBucket;
+
+typedef struct _DirEntryRef {
+  ino_t inode;
+  char * name;
+  int isDir;
+} DirEntryRef;
+
+struct _DirTreeNode;
+
+typedef struct _HeaderStack {
+  struct _DirTreeNode * nodes[FILE_NAME_LENGTH];
+  int pathLength[FILE_NAME_LENGTH];
+  int depth;
+} HeaderStack;
+
 typedef struct _DirTreeNode {
-    char * name;
+    char * name; /* last path component, or the full path for a top node */
+    struct _DirTreeNode * parent;
+    int depth; /* number of parents above */
     struct _DirTreeNode * left;
     struct _DirTreeNode * right;
     ListingNode * items;
@@ -36,30 +80,89 @@ extern int processHiddenFiles;
 extern int quietMode;
 extern int compareMode;
 extern int singleListingMode;
+extern int frontCodedListingMode;
+extern int inodeOrderMode;
+extern int idlePriorityMode;
+extern char throttleControlFile[FILE_NAME_LENGTH];
+extern TokenBucket dirBucket;
+extern TokenBucket entryBucket;
+extern TokenBucket writeBucket;
+extern volatile sig_atomic_t throttleReloadRequested;
+extern char checkpointFileName[FILE_NAME_LENGTH];
+extern int resumeMode;
+extern int resumedDirectories;
+extern FILE * checkpointFile;
+extern struct stat checkpointStat;
+extern time_t lastCheckpointSync;
+extern DiffSummary diffSummary;
 extern DirTreeNode * singleListing;
 
 enum LogType { LOG_ERR, LOG_INFO, LOG_LOG, LOG_DONE };
+enum DiffOutput { DIFF_TEXT, DIFF_JSON, DIFF_SUMMARY };
+
+extern enum DiffOutput diffOutputMode;
 
 int takeSnapshot(const char*);
 void printLog(enum LogType, const char*, int);
 void printUsage(const char*);
-void processDirectory(const char*);
+void processDirectory(const char*, DirTreeNode *);
+void processDirectoryEntry(DirTreeNode *, const char *, const char *);
+int listDirectoryEntry(DirTreeNode *, const char *, const char *);
+void descendIntoDirectory(DirTreeNode *, const char *, const char *);
+int readDirectoryEntries(DIR *, DirEntryRef **, size_t *);
+void freeDirectoryEntries(DirEntryRef *, size_t);
+void processDirectoryByInode(DIR *, DirTreeNode *, const char *);
+int compareEntryInodes(const void *, const void *);
 int writeListing(DirTreeNode*);
 int isDirectory(const char*, const char *);
 void setCompareMode();
 void setVerboseMode();
 void setSeparateListingMode();
+void setFrontCodedListingMode();
+void setInodeOrderMode();
+int setDirRateLimit(const char *);
+int setEntryRateLimit(const char *);
+int setWriteRateLimit(const char *);
+int parseRate(const char *, double *);
+void setIdlePriorityMode();
+void setThrottleControlFile(const char *);
+int initThrottling();
+void applyIdlePriority();
+int loadThrottleControlFile();
+void requestThrottleReload(int);
+void setBucketRate(TokenBucket *, double);
+void throttleTake(TokenBucket *, double);
+ssize_t writeThrottled(int, const char *, size_t);
+void setCheckpointFileName(const char *);
+void setResumeMode();
+int checkCheckpointOptions();
+int checkOutputOptions();
+int openCheckpoint(const char *);
+void formatCheckpointHeader(char *, size_t, const char *);
+int isCheckpointFile(const char *, const char *);
+int loadCheckpoint(const char *);
+void checkpointDirectory(DirTreeNode *);
+long writeCheckpointItems(FILE *, ListingNode *);
+void closeCheckpoint(int);
+void setDiffOutputMode(enum DiffOutput);
 void setDirectoryPrefix(char);
 void setFilePrefix(char);
 void setListingFileName(char *);
 void setProcessHiddenFiles();
 void addToSingleListing(DirTreeNode *);
 int writeSingleListing(DirTreeNode *);
-int writeListingNode(int, DirTreeNode *);
+int writeListingNode(int, DirTreeNode *, char *);
 int writeListingNodeItem(int, ListingNode *);
 
 ListingNode * createNode(const char*, const int);
 DirTreeNode * createTree(const char *);
+DirTreeNode * createChildTree(DirTreeNode *, const char *);
+int getDirTreeNodePath(DirTreeNode *, char *, int);
+int compareDirTreeNodePath(DirTreeNode *, const char *);
+int compareDirTreeNodePrefix(DirTreeNode *, const char **);
+int compareDirTreeNodes(DirTreeNode *, DirTreeNode *);
+int compareComponents(const char *, int, const char *, int);
+int sharedPrefixLength(const char *, const char *);
 void insertNode(DirTreeNode *, DirTreeNode *);
 void insertListingItem(ListingNode *, ListingNode *);
 void freeTree(DirTreeNode *);
@@ -69,8 +172,27 @@ void freeItemLeaf(ListingNode *);
 void freeList(ListingNode *);
 
 DirTreeNode * readLilsting(const char *, const char *);
+DirTreeNode * addListingDirectory(DirTreeNode **, DirTreeNode **, HeaderStack *, const char *, int);
+DirTreeNode * balanceTree(DirTreeNode *);
+int countTreeNodes(DirTreeNode *);
+int flattenTree(DirTreeNode *, DirTreeNode **, int);
+DirTreeNode * buildBalancedTree(DirTreeNode **, int, int);
 void compareTrees(DirTreeNode *, DirTreeNode *, const int);
 DirTreeNode * findDirectory(DirTreeNode *, const char *);
 void compareItemsInDirectory(ListingNode *, ListingNode *, const int);
 ListingNode * findItemInDirectory(ListingNode *, ListingNode *);
 void writeDirDifference(ListingNode *, const int);
+int compareListings(DirTreeNode *, DirTreeNode *, const char *);
+void diffTrees(DirTreeNode *, DirTreeNode *, const int);
+long diffItems(ListingNode *, ListingNode *, const char *, const char);
+void writeDiffEntry(const char, const char *, ListingNode *);
+void writeDiffDirectory(const char *, const char *, long, long);
+void writeDiffSummary();
+void diffWrite(const char *, size_t);
+void diffWriteString(const char *);
+void diffWriteJsonString(const char *);
+void diffWriteJsonField(const char *, const char *);
+void diffWriteBase64(const char *);
+int utf8SequenceLength(const unsigned char *);
+int isValidUtf8(const char *);
+void diffFlush();